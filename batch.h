@@ -0,0 +1,25 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/*
+ * Running a batch of user payloads in one VM.
+ *
+ * Once everything but the user payload is set up, the kernel writes
+ * the address of user_entry (kern.S) to USER_ENTRY_PORT.  When a payload
+ * halts, halo.c restores the user pages it dirtied from the next
+ * payload's image and resumes the vCPU at user_entry, with the
+ * segment and control registers sampled at that port write.
+ */
+#define USER_ENTRY_PORT 0x520
+
+/*
+ * Before halting on a trap it cannot handle, the kernel writes the trap
+ * number to FATAL_TRAP_PORT.  halo.c then counts the payload as failed
+ * and exits nonzero at the end of the batch.
+ */
+#define FATAL_TRAP_PORT 0x524
+
+// User pages mapped by kern_main at 0x00010000
+#define USER_PAGES 5
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * Guest benchmark results.
+ *
+ * The guest writes the cycle count (high half, then low half) and the
+ * amount of work done (bytes or iterations), then the benchmark
+ * number to BENCH_PORT, which commits the record.  halo.c prints one
+ * line per record.  User code reports through T_SYSCALL_BENCH.
+ */
+#define BENCH_PORT      0x510     // benchmark number (byte), commits
+#define BENCH_PORT_LO   0x514     // cycles, bits 31..0
+#define BENCH_PORT_HI   0x518     // cycles, bits 63..32
+#define BENCH_PORT_WORK 0x51c     // bytes or iterations
+#define BENCH_PORT_PIO  0x511     // ignored by halo.c, for BENCH_PIO
+
+// Read by BENCH_MMIO.  It lies in user page 1, which halo.c leaves
+// without a memory slot; halo.c answers reads there with 0, silently.
+#define BENCH_MMIO_VA   0x00011ff0
+
+// Two user pages, not otherwise mapped, that BENCH_PGFLT faults on
+// in turn, reading.  The kernel maps the faulting one read-only and
+// unmaps the other; any other fault on them is fatal.
+#define BENCH_FAULT_VA  0x00016000
+
+#define BENCH_MEMCPY_REP    0
+#define BENCH_MEMCPY_SSE2   1
+#define BENCH_MEMCPY_AVX    2
+#define BENCH_MEMSET_REP    3
+#define BENCH_MEMSET_SSE2   4
+#define BENCH_MEMSET_AVX    5
+#define BENCH_STRLEN_REP    6
+#define BENCH_STRLEN_SSE2   7
+#define BENCH_STRLEN_AVX2   8
+#define BENCH_SYSCALL       9     // int $T_SYSCALL_PUTC of NUL, which trap() drops
+#define BENCH_TRAP         10     // int $T_SYSCALL_NOP
+#define BENCH_PGFLT        11     // user page fault, fixed up by the kernel
+#define BENCH_INVLPG       12     // invlpg, in the kernel
+#define BENCH_TLB_MISS     13     // invlpg, then a load from that page
+#define BENCH_PIO          14     // outb exit to BENCH_PORT_PIO
+#define BENCH_MMIO         15     // user load from BENCH_MMIO_VA
+#define BENCH_NR           16
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef BOOTTS_H
+#define BOOTTS_H
+
+/*
+ * Boot-phase timestamps.
+ *
+ * At each milestone the guest stores its TSC in a uint64_t array,
+ * indexed by milestone, at guest physical BOOT_TS_PA.  That is inside
+ * the bios.S page, below the kernel stack growing down from its end.
+ * Storing takes no exit; halo.c reads the array from its copy of the
+ * page and merges it with its own TSC readings.
+ */
+#define BOOT_TS_PA         0x1100
+
+#define BOOT_TS_BIOS       0        // first instruction of bios.S, real mode
+#define BOOT_TS_PROT       1        // bios.S, protected mode segments loaded
+#define BOOT_TS_KERN       2        // first instruction of kern.S
+#define BOOT_TS_PAGING     3        // kern.S, running at KERNBASE with paging
+#define BOOT_TS_KERN_MAIN  4        // entry of kern_main
+#define BOOT_TS_DESC       5        // GDT/IDT/TSS loaded
+#define BOOT_TS_RUN_USER   6        // user pages mapped, about to run(&user)
+#define BOOT_TS_USER       7        // first user instruction
+#define BOOT_TS_NR         8
+
+#ifdef __ASSEMBLER__
+
+/*
+ * Record milestone 'phase', with BOOT_TS_PA mapped at 'base' + BOOT_TS_PA
+ * (0 before paging, KERNBASE after).  Clobbers %eax and %edx; works in
+ * both .code16 (with %ds = 0) and .code32.
+ */
+#define BOOT_TS(phase, base)                                    \
+        rdtsc;                                                  \
+        movl %eax, (base) + BOOT_TS_PA + 8 * (phase);           \
+        movl %edx, (base) + BOOT_TS_PA + 8 * (phase) + 4
+
+#endif /* __ASSEMBLER__ */
+
+#endif
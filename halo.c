@@ -1,4 +1,5 @@
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/kvm.h>
 #include <stdint.h>
@@ -9,6 +10,12 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "batch.h"
+#include "bench.h"
+#include "bootts.h"
 
 extern uint8_t _binary_memdata_bios_bin_start[];
 extern uint8_t _binary_memdata_bios_bin_end[];
@@ -17,12 +24,281 @@ extern uint8_t _binary_memdata_kernel_bin_end[];
 extern uint8_t _binary_memdata_user_bin_start[];
 extern uint8_t _binary_memdata_user_bin_end[];
 
-int main(void)
+#define MSR_IA32_TSC 0x10
+
+/* Host-side milestones, read with the host TSC. */
+enum {
+    HOST_TS_START,
+    HOST_TS_CREATE_VM,
+    HOST_TS_SLOTS,
+    HOST_TS_VCPU,
+    HOST_TS_NR
+};
+
+static const char *const host_ts_names[HOST_TS_NR] = {
+    [HOST_TS_CREATE_VM] = "KVM_CREATE_VM",
+    [HOST_TS_SLOTS]     = "KVM_SET_USER_MEMORY_REGION",
+    [HOST_TS_VCPU]      = "KVM_CREATE_VCPU + regs",
+};
+
+/* Name of the phase that ends at each guest milestone. */
+static const char *const boot_ts_names[BOOT_TS_NR] = {
+    [BOOT_TS_BIOS]      = "first KVM_RUN",
+    [BOOT_TS_PROT]      = "bios.S real mode",
+    [BOOT_TS_KERN]      = "bios.S protected mode",
+    [BOOT_TS_PAGING]    = "kern.S paging enable",
+    [BOOT_TS_KERN_MAIN] = "kern.S relocate",
+    [BOOT_TS_DESC]      = "kern_main GDT/IDT/TSS",
+    [BOOT_TS_RUN_USER]  = "kern_main user setup",
+    [BOOT_TS_USER]      = "run(&user)",
+};
+
+static uint64_t host_ts[HOST_TS_NR];
+/* The guest's boot_ts array, in bios.S */
+#define guest_ts ((const uint64_t *)(_binary_memdata_bios_bin_start + BOOT_TS_PA - 0x1000))
+/* host TSC - guest TSC, sampled just before the first KVM_RUN */
+static int64_t tsc_offset;
+static int boot_ts_printed;
+
+static void host_ts_mark(int which)
+{
+    host_ts[which] = __rdtsc();
+}
+
+/* Read the guest TSC and the host TSC back to back. */
+static void boot_ts_sync(int vcpufd)
+{
+    struct {
+	struct kvm_msrs info;
+	struct kvm_msr_entry entries[1];
+    } msrs = {
+	.info.nmsrs = 1,
+	.entries[0].index = MSR_IA32_TSC,
+    };
+    int ret;
+
+    ret = ioctl(vcpufd, KVM_GET_MSRS, &msrs);
+    tsc_offset = __rdtsc() - msrs.entries[0].data;
+    if (ret != 1)
+	err(1, "KVM_GET_MSRS");
+}
+
+/* Print the startup breakdown on the host TSC timeline. */
+static void boot_ts_print(void)
+{
+    uint64_t prev = host_ts[HOST_TS_START];
+    uint64_t now;
+    int i;
+
+    if (boot_ts_printed)
+	return;
+    boot_ts_printed = 1;
+
+    printf ("Boot phases (TSC cycles):\n");
+    for (i = HOST_TS_START + 1; i < HOST_TS_NR; i++) {
+	printf ("  %-28s %12llu\n", host_ts_names[i],
+		(unsigned long long)(host_ts[i] - prev));
+	prev = host_ts[i];
+    }
+    for (i = 0; i < BOOT_TS_NR; i++) {
+	if (!guest_ts[i])
+	    continue;
+	now = guest_ts[i] + tsc_offset;
+	printf ("  %-28s %12llu\n", boot_ts_names[i],
+		(unsigned long long)(now - prev));
+	prev = now;
+    }
+    printf ("  %-28s %12llu\n", "total",
+	    (unsigned long long)(prev - host_ts[HOST_TS_START]));
+}
+
+static const struct {
+    const char *name;
+    const char *unit;       /* what BENCH_PORT_WORK counts */
+    const char *one;        /* singular of unit */
+    int per_cycle;          /* print units per cycle, not cycles per unit */
+} bench_names[BENCH_NR] = {
+    [BENCH_MEMCPY_REP]  = { "memcpy_rep",   "bytes", "byte", 1 },
+    [BENCH_MEMCPY_SSE2] = { "memcpy_sse2",  "bytes", "byte", 1 },
+    [BENCH_MEMCPY_AVX]  = { "memcpy_avx",   "bytes", "byte", 1 },
+    [BENCH_MEMSET_REP]  = { "memset_rep",   "bytes", "byte", 1 },
+    [BENCH_MEMSET_SSE2] = { "memset_sse2",  "bytes", "byte", 1 },
+    [BENCH_MEMSET_AVX]  = { "memset_avx",   "bytes", "byte", 1 },
+    [BENCH_STRLEN_REP]  = { "strlen_rep",   "bytes", "byte", 1 },
+    [BENCH_STRLEN_SSE2] = { "strlen_sse2",  "bytes", "byte", 1 },
+    [BENCH_STRLEN_AVX2] = { "strlen_avx2",  "bytes", "byte", 1 },
+    [BENCH_SYSCALL]     = { "syscall_putc", "iters", "iter", 0 },
+    [BENCH_TRAP]        = { "trap_empty",   "iters", "iter", 0 },
+    [BENCH_PGFLT]       = { "page_fault",   "iters", "iter", 0 },
+    [BENCH_INVLPG]      = { "invlpg",       "iters", "iter", 0 },
+    [BENCH_TLB_MISS]    = { "invlpg_tlb_miss", "iters", "iter", 0 },
+    [BENCH_PIO]         = { "pio_exit",     "iters", "iter", 0 },
+    [BENCH_MMIO]        = { "mmio_exit",    "iters", "iter", 0 },
+};
+
+static uint32_t bench_lo, bench_hi, bench_work;
+
+/* Handle a write to one of the BENCH ports. */
+static void bench_io(struct kvm_run *run)
+{
+    uint8_t *data = (uint8_t *)run + run->io.data_offset;
+    uint64_t cycles;
+    uint8_t id;
+
+    switch (run->io.port) {
+    case BENCH_PORT_LO:
+	memcpy(&bench_lo, data, sizeof(bench_lo));
+	break;
+    case BENCH_PORT_HI:
+	memcpy(&bench_hi, data, sizeof(bench_hi));
+	break;
+    case BENCH_PORT_WORK:
+	memcpy(&bench_work, data, sizeof(bench_work));
+	break;
+    case BENCH_PORT_PIO:
+	break;
+    case BENCH_PORT:
+	id = *data;
+	if (id >= BENCH_NR)
+	    errx(1, "bad benchmark number %u", id);
+	cycles = (uint64_t)bench_hi << 32 | bench_lo;
+	if (bench_names[id].per_cycle)
+	    printf ("bench %-16s %10u %s %12llu cycles %10.3f %s/cycle\n",
+		    bench_names[id].name, bench_work, bench_names[id].unit,
+		    (unsigned long long)cycles,
+		    cycles ? (double)bench_work / cycles : 0.0,
+		    bench_names[id].unit);
+	else
+	    printf ("bench %-16s %10u %s %12llu cycles %10.1f cycles/%s\n",
+		    bench_names[id].name, bench_work, bench_names[id].unit,
+		    (unsigned long long)cycles,
+		    bench_work ? (double)cycles / bench_work : 0.0,
+		    bench_names[id].one);
+	break;
+    }
+}
+
+static int is_bench_io(struct kvm_run *run)
+{
+    if (run->io.direction != KVM_EXIT_IO_OUT || run->io.count != 1)
+	return 0;
+    if (run->io.port == BENCH_PORT || run->io.port == BENCH_PORT_PIO)
+	return run->io.size == 1;
+    if (run->io.port == BENCH_PORT_LO || run->io.port == BENCH_PORT_HI ||
+	run->io.port == BENCH_PORT_WORK)
+	return run->io.size == 4;
+    return 0;
+}
+
+#define USER_SIZE (USER_PAGES * 4096)
+/* User page left without a memory slot, so accesses exit as MMIO */
+#define USER_HOLE 1
+
+static uint8_t *user_mem;       /* guest user region */
+static int user_slot;           /* memory slot of user page 0 */
+static uint64_t user_phys;      /* guest physical address of user page 0 */
+static uint64_t user_entry;     /* guest address of user_entry, 0 until announced */
+static struct kvm_sregs user_sregs;
+static uint64_t payload_start;
+static int payload_trap = -1;   /* fatal trap of the current payload */
+
+/* Pristine copy of a user image, zero-padded to USER_SIZE. */
+static uint8_t *user_image(const uint8_t *data, size_t size, const char *name)
+{
+    uint8_t *image;
+
+    if (size > USER_SIZE)
+        errx(1, "%s: %zu bytes, the user region holds %d", name, size, USER_SIZE);
+    image = calloc(1, USER_SIZE);
+    if (!image)
+        err(1, "calloc");
+    memcpy(image, data, size);
+    return image;
+}
+
+static uint8_t *user_image_load(const char *path)
+{
+    struct stat st;
+    uint8_t *data, *image;
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        err(1, "%s", path);
+    if (fstat(fd, &st) == -1)
+        err(1, "%s", path);
+    data = malloc(st.st_size + 1);
+    if (!data)
+        err(1, "malloc");
+    n = read(fd, data, st.st_size + 1);
+    if (n == -1)
+        err(1, "%s", path);
+    close(fd);
+
+    image = user_image(data, n, path);
+    free(data);
+    return image;
+}
+
+/*
+ * Bring the user region from the state 'prev' left it in back to the
+ * pristine image 'next'.  Only pages the guest dirtied, or that differ
+ * between the two images, are copied.  Returns the number copied.
+ */
+static int user_reset(int vmfd, const uint8_t *prev, const uint8_t *next)
+{
+    struct kvm_dirty_log log;
+    uint64_t bitmap;
+    int page, restored = 0;
+
+    for (page = 0; page < USER_PAGES; page++) {
+	if (page == USER_HOLE)
+	    continue;
+	bitmap = 0;
+	log.slot = user_slot + page;
+	log.dirty_bitmap = &bitmap;
+	if (ioctl(vmfd, KVM_GET_DIRTY_LOG, &log) == -1)
+	    err(1, "KVM_GET_DIRTY_LOG");
+	if (!bitmap && !memcmp(prev + page * 4096, next + page * 4096, 4096))
+	    continue;
+	memcpy(user_mem + page * 4096, next + page * 4096, 4096);
+	restored++;
+    }
+    return restored;
+}
+
+/*
+ * Usage: a.out [user.bin...]
+ *
+ * Runs each raw user image (as made by objcopy -O binary, see
+ * memdata.user.bin) in turn, in the same VM.  Without arguments runs
+ * the user image linked into a.out.
+ */
+int main(int argc, char **argv)
 {
     int kvm, vmfd, vcpufd, ret;
     struct kvm_sregs sregs;
     size_t mmap_size;
     struct kvm_run *run;
+    uint8_t **images;
+    int nimages, payload = 0, nfailed = 0;
+    int i;
+
+    host_ts_mark(HOST_TS_START);
+
+    nimages = argc > 1 ? argc - 1 : 1;
+    images = calloc(nimages, sizeof(*images));
+    if (!images)
+        err(1, "calloc");
+    if (argc > 1) {
+        for (i = 0; i < nimages; i++)
+            images[i] = user_image_load(argv[i + 1]);
+    } else {
+        images[0] = user_image(_binary_memdata_user_bin_start,
+                               _binary_memdata_user_bin_end - _binary_memdata_user_bin_start,
+                               "memdata.user.bin");
+    }
 
     kvm = open("/dev/kvm", O_RDWR | O_CLOEXEC);
     if (kvm == -1)
@@ -38,7 +314,7 @@ int main(void)
     vmfd = ioctl(kvm, KVM_CREATE_VM, (unsigned long)0);
     if (vmfd == -1)
         err(1, "KVM_CREATE_VM");
-
+    host_ts_mark(HOST_TS_CREATE_VM);
 
 #define ROUND_UP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
 
@@ -78,10 +354,21 @@ int main(void)
 	    err(1, "KVM_SET_USER_MEMORY_REGION");
     }
 
-    for (userspace_addr = (uint64_t)_binary_memdata_user_bin_start;
-	 userspace_addr < (uint64_t)_binary_memdata_user_bin_end;
+    /* The user region is reloaded between payloads, so it has its own
+     * memory and tracks which pages the guest writes. */
+    user_mem = mmap(NULL, USER_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (user_mem == MAP_FAILED)
+	err(1, "mmap user");
+    memcpy(user_mem, images[0], USER_SIZE);
+    user_slot = slot;
+    user_phys = physaddr;
+    region.flags = KVM_MEM_LOG_DIRTY_PAGES;
+
+    for (userspace_addr = (uint64_t)user_mem;
+	 userspace_addr < (uint64_t)user_mem + USER_SIZE;
 	 slot += 1, physaddr += 4096, userspace_addr += 4096) {
-	if (userspace_addr == (uint64_t)_binary_memdata_user_bin_start + 1 * 4096)
+	if (userspace_addr == (uint64_t)user_mem + USER_HOLE * 4096)
 	    continue;
 	region.slot = slot;
 	region.guest_phys_addr = physaddr;
@@ -93,6 +380,7 @@ int main(void)
 	if (ret == -1)
 	    err(1, "KVM_SET_USER_MEMORY_REGION");
     }
+    host_ts_mark(HOST_TS_SLOTS);
 
 
     vcpufd = ioctl(vmfd, KVM_CREATE_VCPU, (unsigned long)0);
@@ -110,6 +398,28 @@ int main(void)
     if (!run)
         err(1, "mmap vcpu");
 
+    /* Pass the host CPU features through, so the guest can use SSE/AVX. */
+    struct kvm_cpuid2 *cpuid;
+    int nent;
+
+    /* Grow the buffer until it fits; KVM has at most 256 entries. */
+    for (nent = 64; ; nent *= 2) {
+        cpuid = calloc(1, sizeof(*cpuid) + nent * sizeof(cpuid->entries[0]));
+        if (!cpuid)
+            err(1, "calloc");
+        cpuid->nent = nent;
+        ret = ioctl(kvm, KVM_GET_SUPPORTED_CPUID, cpuid);
+        if (ret == 0)
+            break;
+        if (errno != E2BIG || nent >= 256)
+            err(1, "KVM_GET_SUPPORTED_CPUID");
+        free(cpuid);
+    }
+    ret = ioctl(vcpufd, KVM_SET_CPUID2, cpuid);
+    if (ret == -1)
+        err(1, "KVM_SET_CPUID2");
+    free(cpuid);
+
     /* Initialize CS to point at 0, via a read-modify-write of sregs. */
     ret = ioctl(vcpufd, KVM_GET_SREGS, &sregs);
     if (ret == -1)
@@ -129,6 +439,9 @@ int main(void)
     ret = ioctl(vcpufd, KVM_SET_REGS, &regs);
     if (ret == -1)
         err(1, "KVM_SET_REGS");
+    host_ts_mark(HOST_TS_VCPU);
+
+    boot_ts_sync(vcpufd);
 
     /* Repeatedly run code and handle VM exits. */
     while (1) {
@@ -137,6 +450,10 @@ int main(void)
             err(1, "KVM_RUN");
         switch (run->exit_reason) {
 	case KVM_EXIT_MMIO:
+	    if (run->mmio.phys_addr == user_phys + USER_HOLE * 4096 + (BENCH_MMIO_VA & 0xfff)) {
+		memset(run->mmio.data, 0, sizeof(run->mmio.data));
+		break;
+	    }
 	    printf ("KVM_EXIT_MMIO: phys_addr[0x%llx]\n", run->mmio.phys_addr);
 	    printf ("KVM_EXIT_MMIO: data[%x]\n", *(uint8_t *)run->mmio.data);
 	    printf ("KVM_EXIT_MMIO: len[%x]\n", run->mmio.len);
@@ -147,14 +464,59 @@ int main(void)
 	    break;
         case KVM_EXIT_HLT:
             puts("KVM_EXIT_HLT");
+	    boot_ts_print();
 	ioctl(vcpufd, KVM_GET_REGS, &regs);
 	printf ("now rip[0x%llx]\n", regs.rip);
 	printf ("now eax[0x%llx]\n", regs.rax);
-            return 0;
+	    if (user_entry)
+		printf ("payload %d: %llu cycles\n", payload,
+			(unsigned long long)(__rdtsc() - payload_start));
+	    if (payload_trap != -1) {
+		printf ("payload %d: failed, trap %d\n", payload, payload_trap);
+		nfailed++;
+		payload_trap = -1;
+	    }
+	    if (++payload == nimages) {
+		if (nfailed)
+		    errx(1, "%d of %d payloads failed", nfailed, nimages);
+		return 0;
+	    }
+	    if (!user_entry)
+		errx(1, "halted before the kernel reached user_entry");
+
+	    /* Reset in place and re-enter the kernel at user_entry. */
+	    ret = user_reset(vmfd, images[payload - 1], images[payload]);
+	    printf ("payload %d: %d user pages restored\n", payload, ret);
+	    ret = ioctl(vcpufd, KVM_SET_SREGS, &user_sregs);
+	    if (ret == -1)
+		err(1, "KVM_SET_SREGS");
+	    regs = (struct kvm_regs) {
+		.rip = user_entry,
+		.rflags = 0x2,
+	    };
+	    ret = ioctl(vcpufd, KVM_SET_REGS, &regs);
+	    if (ret == -1)
+		err(1, "KVM_SET_REGS");
+	    /* Payload cycles start here, leaving out the reset. */
+	    payload_start = __rdtsc();
+	    break;
         case KVM_EXIT_IO:
             if (run->io.direction == KVM_EXIT_IO_OUT && run->io.size == 1 && run->io.port == 0x3f8 && run->io.count == 1) {
                 putchar(*(((char *)run) + run->io.data_offset));
 	    }
+	    else if (is_bench_io(run))
+		bench_io(run);
+	    else if (run->io.direction == KVM_EXIT_IO_OUT && run->io.size == 4 &&
+		     run->io.port == USER_ENTRY_PORT && run->io.count == 1) {
+		user_entry = *(uint32_t *)((uint8_t *)run + run->io.data_offset);
+		ret = ioctl(vcpufd, KVM_GET_SREGS, &user_sregs);
+		if (ret == -1)
+		    err(1, "KVM_GET_SREGS");
+		payload_start = __rdtsc();
+	    }
+	    else if (run->io.direction == KVM_EXIT_IO_OUT && run->io.size == 4 &&
+		     run->io.port == FATAL_TRAP_PORT && run->io.count == 1)
+		payload_trap = *(uint32_t *)((uint8_t *)run + run->io.data_offset);
             else
                 errx(1, "unhandled KVM_EXIT_IO");
             break;
@@ -165,11 +527,10 @@ int main(void)
 	ioctl(vcpufd, KVM_GET_REGS, &regs);
 	printf ("now rip[0x%llx]\n", regs.rip);
 	printf ("now eax[0x%llx]\n", regs.rax);
+	    boot_ts_print();
             errx(1, "KVM_EXIT_INTERNAL_ERROR: suberror = 0x%x", run->internal.suberror);
         default:
             errx(1, "exit_reason = 0x%x", run->exit_reason);
         }
-	ioctl(vcpufd, KVM_GET_REGS, &regs);
-//	printf ("now rip[0x%llx]\n", regs.rip);
     }
 }
@@ -1,4 +1,8 @@
 #include "mmu.h"
+#include "batch.h"
+#include "bootts.h"
+#include "bench.h"
+#include "lib.h"
 
 typedef uint32_t pte_t;
 typedef uint32_t pde_t;
@@ -90,8 +94,148 @@ void puts(const char *str) {
     kern_putc('\n');
 }
 
+static inline void boot_ts_store(uint8_t phase, uint64_t tsc)
+{
+  ((volatile uint64_t *)(KERNBASE + BOOT_TS_PA))[phase] = tsc;
+}
+
+static inline void boot_ts(uint8_t phase)
+{
+  boot_ts_store(phase, rdtsc());
+}
+
+// FPU/SIMD state of the interrupted user code, saved by _alltraps and
+// restored by run().  Big enough for the x87, SSE and AVX components.
+// Traps taken in the kernel leave it alone and do not preserve the
+// kernel's own FPU/SIMD state.
+int fpu_mode = FPU_NONE;
+__attribute__((__aligned__(64)))
+uint8_t fpu_state[1024];
+// State right after fpu_init(), handed to every user payload
+__attribute__((__aligned__(64)))
+static uint8_t fpu_init_state[1024];
+
+extern void fpu_save(void);
+extern void fpu_restore(void);
+
+static void
+fpu_init(void)
+{
+  uint32_t max, a, b, c, d;
+  uint32_t cr0, cr4, xcr0;
+
+  cpuid(0, 0, &max, &b, &c, &d);
+  if (max < 1)
+    return;
+  cpuid(1, 0, &a, &b, &c, &d);
+  if (!(d & CPUID_1_EDX_FXSR))
+    return;
+
+  asm volatile("movl %%cr0,%0" : "=r" (cr0));
+  cr0 &= ~(CR0_EM | CR0_TS);
+  cr0 |= CR0_MP | CR0_NE;
+  asm volatile("movl %0,%%cr0" : : "r" (cr0));
+
+  asm volatile("movl %%cr4,%0" : "=r" (cr4));
+  cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+  fpu_mode = FPU_FXSAVE;
+
+  if ((c & CPUID_1_ECX_XSAVE) && max >= 0xd) {
+    cr4 |= CR4_OSXSAVE;
+    asm volatile("movl %0,%%cr4" : : "r" (cr4));
+    // Enable AVX only if its state fits in fpu_state; otherwise
+    // lib_init() must not see it.  x87 and SSE state always fit.
+    xcr0 = XCR0_X87 | XCR0_SSE;
+    if (c & CPUID_1_ECX_AVX) {
+      // EAX: size, EBX: offset of the AVX component
+      cpuid(0xd, 2, &a, &b, &c, &d);
+      if (a + b <= sizeof(fpu_state))
+	xcr0 |= XCR0_AVX;
+    }
+    asm volatile("xsetbv" : : "a" (xcr0), "d" (0), "c" (0));
+    fpu_mode = FPU_XSAVE;
+  } else
+    asm volatile("movl %0,%%cr4" : : "r" (cr4));
+
+  // The first run() restores this clean state.
+  asm volatile("fninit");
+  fpu_save();
+  memcpy(fpu_init_state, fpu_state, sizeof(fpu_state));
+}
+
+static void
+fpu_reset(void)
+{
+  memcpy(fpu_state, fpu_init_state, sizeof(fpu_state));
+}
+
+static void bench_put(uint8_t id, uint64_t cycles, uint32_t work)
+{
+  asm volatile("outl %0,%w1" : : "a" ((uint32_t)(cycles >> 32)), "d" (BENCH_PORT_HI));
+  asm volatile("outl %0,%w1" : : "a" ((uint32_t)cycles), "d" (BENCH_PORT_LO));
+  asm volatile("outl %0,%w1" : : "a" (work), "d" (BENCH_PORT_WORK));
+  asm volatile("outb %0,%w1" : : "a" (id), "d" (BENCH_PORT));
+}
+
+#ifdef STRING_BENCH
+
+#define BENCH_SIZE  PGSIZE
+#define BENCH_ITERS 1024
+
+__attribute__((__aligned__(PGSIZE)))
+static char bench_src[BENCH_SIZE];
+__attribute__((__aligned__(PGSIZE)))
+static char bench_dst[BENCH_SIZE];
+
+static void string_bench(int features)
+{
+  static void *(*const memcpys[])(void *, const void *, size_t) = {
+    memcpy_rep, memcpy_sse2, memcpy_avx
+  };
+  static void *(*const memsets[])(void *, int, size_t) = {
+    memset_rep, memset_sse2, memset_avx
+  };
+  static size_t (*const strlens[])(const char *) = {
+    strlen_rep, strlen_sse2, strlen_avx2
+  };
+  static const int needs[] = { 0, LIB_SSE2, LIB_AVX };
+  uint64_t start;
+  int v, i;
+
+  memset_rep(bench_src, 'x', BENCH_SIZE - 1);
+  bench_src[BENCH_SIZE - 1] = '\0';
+
+  for (v = 0; v < 3; v++) {
+    if ((features & needs[v]) != needs[v])
+      continue;
+
+    start = rdtsc();
+    for (i = 0; i < BENCH_ITERS; i++)
+      memcpys[v](bench_dst, bench_src, BENCH_SIZE);
+    bench_put(BENCH_MEMCPY_REP + v, rdtsc() - start, BENCH_SIZE * BENCH_ITERS);
+
+    start = rdtsc();
+    for (i = 0; i < BENCH_ITERS; i++)
+      memsets[v](bench_dst, i, BENCH_SIZE);
+    bench_put(BENCH_MEMSET_REP + v, rdtsc() - start, BENCH_SIZE * BENCH_ITERS);
+
+    if (v == 2 && !(features & LIB_AVX2))
+      continue;
+    start = rdtsc();
+    for (i = 0; i < BENCH_ITERS; i++)
+      strlens[v](bench_src);
+    bench_put(BENCH_STRLEN_REP + v, rdtsc() - start,
+	      (BENCH_SIZE - 1) * BENCH_ITERS);
+  }
+}
+#endif
+
 static struct Taskstate cpu_ts;
 
+static struct Trapframe user;
+// Physical address of user page 0; BENCH_FAULT_VA pages map it read-only.
+static physaddr_t user_pa;
+
 static const char *trapname(int trapno)
 {
   static const char * const excnames[] = {
@@ -123,12 +267,22 @@ static const char *trapname(int trapno)
     return "System call putc";
   if (trapno == T_SYSCALL_HLT)
     return "System call hlt";
+  if (trapno == T_SYSCALL_TS)
+    return "System call timestamp";
+  if (trapno == T_SYSCALL_NOP)
+    return "System call nop";
+  if (trapno == T_SYSCALL_BENCH)
+    return "System call benchmark result";
+  if (trapno == T_SYSCALL_KBENCH)
+    return "System call kernel benchmarks";
   return "(unknown trap)";
 }
 
 void
 run(struct Trapframe *tf)
 {
+  if ((tf->tf_cs & 3) == 3)
+    fpu_restore();
   asm volatile("\tmovl %0,%%esp\n"
 	       "\tpopal\n"
 	       "\tpopl %%es\n"
@@ -138,13 +292,105 @@ run(struct Trapframe *tf)
 	       : : "g" (tf) : "memory");
 }
 
+static inline void
+invlpg(void *addr)
+{
+        asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
+static inline uint32_t
+rcr2(void)
+{
+  uint32_t val;
+  asm volatile("movl %%cr2,%0" : "=r" (val));
+  return val;
+}
+
+// Not-present read fault at 'va' from BENCH_PGFLT: map that
+// BENCH_FAULT_VA page read-only, unmap the other one.  Returns 0 if 'va' is not one of them.
+static int
+bench_fault(uintptr_t va)
+{
+  uintptr_t page = va & ~(PGSIZE - 1);
+  uintptr_t other;
+
+  if (page == BENCH_FAULT_VA)
+    other = BENCH_FAULT_VA + PGSIZE;
+  else if (page == BENCH_FAULT_VA + PGSIZE)
+    other = BENCH_FAULT_VA;
+  else
+    return 0;
+
+  user_ptes[(page >> 12) & 0x3ff] = user_pa | PTE_P | PTE_U;
+  user_ptes[(other >> 12) & 0x3ff] = 0;
+  invlpg((void *)other);
+  return 1;
+}
+
+static void
+bench_fault_reset(void)
+{
+  user_ptes[(BENCH_FAULT_VA >> 12) & 0x3ff] = 0;
+  user_ptes[((BENCH_FAULT_VA + PGSIZE) >> 12) & 0x3ff] = 0;
+  invlpg((void *)BENCH_FAULT_VA);
+  invlpg((void *)(BENCH_FAULT_VA + PGSIZE));
+}
+
+#define KBENCH_ITERS 1000
+
+// Benchmarks of privileged primitives, run for T_SYSCALL_KBENCH.
+static void
+kern_bench(void)
+{
+  volatile uint8_t *va = (uint8_t *)0x00010000;
+  uint64_t start;
+  int i;
+
+  start = rdtsc();
+  for (i = 0; i < KBENCH_ITERS; i++)
+    invlpg((void *)va);
+  bench_put(BENCH_INVLPG, rdtsc() - start, KBENCH_ITERS);
+
+  start = rdtsc();
+  for (i = 0; i < KBENCH_ITERS; i++) {
+    invlpg((void *)va);
+    (void)*va;
+  }
+  bench_put(BENCH_TLB_MISS, rdtsc() - start, KBENCH_ITERS);
+
+  start = rdtsc();
+  for (i = 0; i < KBENCH_ITERS; i++)
+    asm volatile("outb %0,%w1" : : "a" ((uint8_t)0), "d" (BENCH_PORT_PIO));
+  bench_put(BENCH_PIO, rdtsc() - start, KBENCH_ITERS);
+}
+
 void
 trap(struct Trapframe *tf)
 {
   if (tf->tf_trapno == T_SYSCALL_PUTC) {
-      kern_putc(tf->tf_regs.reg_eax);
+      // NUL is not printed, so BENCH_SYSCALL returns without an exit
+      if ((char)tf->tf_regs.reg_eax != '\0')
+	  kern_putc(tf->tf_regs.reg_eax);
   } else if (tf->tf_trapno == T_SYSCALL_HLT) {
       kern_hlt();
+  } else if (tf->tf_trapno == T_SYSCALL_TS) {
+      // %ecx = milestone, %edx:%eax = TSC read by the caller
+      if (tf->tf_regs.reg_ecx < BOOT_TS_NR)
+	  boot_ts_store(tf->tf_regs.reg_ecx,
+			(uint64_t)tf->tf_regs.reg_edx << 32 | tf->tf_regs.reg_eax);
+  } else if (tf->tf_trapno == T_SYSCALL_NOP) {
+      // nothing: BENCH_TRAP times the round trip
+  } else if (tf->tf_trapno == T_SYSCALL_BENCH) {
+      // %ecx = benchmark, %edx:%eax = cycles, %ebx = work
+      bench_put(tf->tf_regs.reg_ecx,
+		(uint64_t)tf->tf_regs.reg_edx << 32 | tf->tf_regs.reg_eax,
+		tf->tf_regs.reg_ebx);
+  } else if (tf->tf_trapno == T_SYSCALL_KBENCH) {
+      kern_bench();
+  } else if (tf->tf_trapno == T_PGFLT && (tf->tf_cs & 3) == 3 &&
+	     !(tf->tf_err & (FEC_PR | FEC_WR)) && bench_fault(rcr2())) {
+      // retry the access.  Writes and protection faults stay fatal:
+      // the pages are read-only, so retrying would fault forever.
   } else {
       if ((tf->tf_cs & 3) == 3) {
 	  // Trapped from user mode.
@@ -152,20 +398,28 @@ trap(struct Trapframe *tf)
       } else
 	puts ("trap occures!");
       puts(trapname(tf->tf_trapno));
+      asm volatile("outl %0,%w1" : : "a" (tf->tf_trapno), "d" (FATAL_TRAP_PORT));
       kern_hlt();
   }
 
   run(tf);
 }
 
-static inline void
-invlpg(void *addr)
+// Reached through user_entry in kern.S, on a fresh kernel stack, for
+// every user payload.  Nothing here may depend on what the previous
+// payload left behind.
+void
+user_start(void)
 {
-        asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+  fpu_reset();
+  bench_fault_reset();
+  run(&user);
 }
 
 void kern_main() {
 
+    boot_ts(BOOT_TS_KERN_MAIN);
+
     // Load the IDT
     asm volatile("lidt (%0)" : : "r" (&idt_pd));
 
@@ -205,6 +459,10 @@ void kern_main() {
     extern void trap_SIMDERR();
     extern void trap_SYSCALL_PUTC();
     extern void trap_SYSCALL_HLT();
+    extern void trap_SYSCALL_TS();
+    extern void trap_SYSCALL_NOP();
+    extern void trap_SYSCALL_BENCH();
+    extern void trap_SYSCALL_KBENCH();
 
     SETGATE (idt[T_DIVIDE], 0, GD_KT, trap_DIVIDE,  0)
     SETGATE (idt[T_DEBUG],  0, GD_KT, trap_DEBUG,   0)
@@ -226,6 +484,10 @@ void kern_main() {
     SETGATE (idt[T_SIMDERR],        0, GD_KT, trap_SIMDERR, 0)
     SETGATE (idt[T_SYSCALL_PUTC],        0, GD_KT, trap_SYSCALL_PUTC, 3)
     SETGATE (idt[T_SYSCALL_HLT],        0, GD_KT, trap_SYSCALL_HLT, 3)
+    SETGATE (idt[T_SYSCALL_TS],        0, GD_KT, trap_SYSCALL_TS, 3)
+    SETGATE (idt[T_SYSCALL_NOP],        0, GD_KT, trap_SYSCALL_NOP, 3)
+    SETGATE (idt[T_SYSCALL_BENCH],        0, GD_KT, trap_SYSCALL_BENCH, 3)
+    SETGATE (idt[T_SYSCALL_KBENCH],        0, GD_KT, trap_SYSCALL_KBENCH, 3)
 
 
     extern char kern_stack[];
@@ -242,13 +504,23 @@ void kern_main() {
     // bottom three bits are special; we leave them 0)
     asm volatile("ltr %%ax" : : "a" (GD_TSS0));
 
+    boot_ts(BOOT_TS_DESC);
+
+    fpu_init();
+#ifdef STRING_BENCH
+    string_bench(lib_init());
+#else
+    lib_init();
+#endif
+
 #define ROUND_UP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
     extern char kernel_end[];
     physaddr_t kernel_end_pa = ROUND_UP((uintptr_t)kernel_end - KERNBASE, 4096);
+    user_pa = kernel_end_pa;
     int i;
     uintptr_t user_va =  0x00010000;
     int user_pageN = 0x010;
-    for(i = 0; i < 5;i++) {
+    for(i = 0; i < USER_PAGES;i++) {
 	user_ptes[(user_va >> 12) & 0x3ff] = kernel_end_pa | PTE_P | PTE_W | PTE_U;
         asm volatile("invlpg (%0)" : : "r" ((void*)user_va) : "memory");
 	kernel_end_pa += 4096;
@@ -256,7 +528,6 @@ void kern_main() {
     }
     entry_pgdir[user_va >> 22] = ((uintptr_t)user_ptes - KERNBASE) | PTE_P | PTE_W | PTE_U;
 
-    struct Trapframe user;
     user.tf_eip = 0x00010000;
     user.tf_cs = GD_UT | 3;
     user.tf_es = GD_UD | 3;
@@ -264,8 +535,12 @@ void kern_main() {
     user.tf_ss = GD_UD | 3;
     user.tf_eflags = FL_IF;
 
+    boot_ts(BOOT_TS_RUN_USER);
     puts("Let's run user!!!!");
-    run(&user);
+
+    extern void user_entry(void);
+    asm volatile("outl %0,%w1" : : "a" (user_entry), "d" (USER_ENTRY_PORT));
+    user_entry();
 
     puts("OVER!!");
     kern_hlt();
@@ -0,0 +1,69 @@
+#ifndef LIB_H
+#define LIB_H
+
+#include "mmu.h"
+
+typedef uint32_t size_t;
+
+// CPUID.1:EDX
+#define CPUID_1_EDX_FXSR    (1 << 24)
+#define CPUID_1_EDX_SSE2    (1 << 26)
+// CPUID.1:ECX
+#define CPUID_1_ECX_XSAVE   (1 << 26)
+#define CPUID_1_ECX_OSXSAVE (1 << 27)
+#define CPUID_1_ECX_AVX     (1 << 28)
+// CPUID.(7,0):EBX
+#define CPUID_7_EBX_AVX2    (1 << 5)
+#define CPUID_7_EBX_ERMS    (1 << 9)
+
+static inline void
+cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx,
+      uint32_t *ecx, uint32_t *edx)
+{
+  asm volatile("cpuid"
+	       : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+	       : "a" (leaf), "c" (subleaf));
+}
+
+static inline uint64_t
+xgetbv(uint32_t index)
+{
+  uint32_t lo, hi;
+  asm volatile("xgetbv" : "=a" (lo), "=d" (hi) : "c" (index));
+  return (uint64_t)hi << 32 | lo;
+}
+
+static inline uint64_t
+rdtsc(void)
+{
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return (uint64_t)hi << 32 | lo;
+}
+
+void *memcpy(void *dst, const void *src, size_t n);
+void *memset(void *dst, int c, size_t n);
+size_t strlen(const char *s);
+
+// Variants implemented in lib.S.  The AVX ones need CR4.OSXSAVE and
+// XCR0 AVX state enabled; strlen_avx2 needs AVX2 as well.
+void *memcpy_rep(void *dst, const void *src, size_t n);
+void *memcpy_sse2(void *dst, const void *src, size_t n);
+void *memcpy_avx(void *dst, const void *src, size_t n);
+void *memset_rep(void *dst, int c, size_t n);
+void *memset_sse2(void *dst, int c, size_t n);
+void *memset_avx(void *dst, int c, size_t n);
+size_t strlen_rep(const char *s);
+size_t strlen_sse2(const char *s);
+size_t strlen_avx2(const char *s);
+
+#define LIB_SSE2 0x1
+#define LIB_AVX  0x2
+#define LIB_AVX2 0x4
+#define LIB_ERMS 0x8
+
+// Pick the memcpy/memset/strlen variants for this CPU.  Until called
+// the rep-string variants are used.  Returns the LIB_* feature mask.
+int lib_init(void);
+
+#endif
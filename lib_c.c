@@ -0,0 +1,73 @@
+#include "lib.h"
+
+static void *(*memcpy_impl)(void *, const void *, size_t) = memcpy_rep;
+static void *(*memset_impl)(void *, int, size_t) = memset_rep;
+static size_t (*strlen_impl)(const char *) = strlen_rep;
+
+void *memcpy(void *dst, const void *src, size_t n)
+{
+  return memcpy_impl(dst, src, n);
+}
+
+void *memset(void *dst, int c, size_t n)
+{
+  return memset_impl(dst, c, n);
+}
+
+size_t strlen(const char *s)
+{
+  return strlen_impl(s);
+}
+
+static int lib_features(void)
+{
+  uint32_t max, a, b, c, d;
+  int features = 0;
+
+  cpuid(0, 0, &max, &b, &c, &d);
+  if (max < 1)
+    return 0;
+
+  cpuid(1, 0, &a, &b, &c, &d);
+  // SSE needs CR4.OSFXSR, which has no CPUID bit; the kernel sets it
+  // together with OSXSAVE whenever FXSR is present.
+  if ((d & CPUID_1_EDX_FXSR) && (d & CPUID_1_EDX_SSE2))
+    features |= LIB_SSE2;
+  if ((c & CPUID_1_ECX_OSXSAVE) && (c & CPUID_1_ECX_AVX) &&
+      (xgetbv(0) & (XCR0_SSE | XCR0_AVX)) == (XCR0_SSE | XCR0_AVX))
+    features |= LIB_AVX;
+
+  if (max < 7)
+    return features;
+  cpuid(7, 0, &a, &b, &c, &d);
+  if ((features & LIB_AVX) && (b & CPUID_7_EBX_AVX2))
+    features |= LIB_AVX2;
+  if (b & CPUID_7_EBX_ERMS)
+    features |= LIB_ERMS;
+  return features;
+}
+
+int lib_init(void)
+{
+  int features = lib_features();
+
+  // With ERMS the microcode rep movsb/stosb beats the vector loops
+  // for all but tiny sizes.
+  if (features & LIB_ERMS) {
+    memcpy_impl = memcpy_rep;
+    memset_impl = memset_rep;
+  } else if (features & LIB_AVX) {
+    memcpy_impl = memcpy_avx;
+    memset_impl = memset_avx;
+  } else if (features & LIB_SSE2) {
+    memcpy_impl = memcpy_sse2;
+    memset_impl = memset_sse2;
+  }
+
+  if (features & LIB_AVX2)
+    strlen_impl = strlen_avx2;
+  else if (features & LIB_SSE2)
+    strlen_impl = strlen_sse2;
+
+  return features;
+}
@@ -219,6 +219,19 @@ struct Trapframe {
 #define CR0_CD 0x40000000 // Cache Disable
 #define CR0_PG 0x80000000 // Paging
 
+#define CR4_OSFXSR     0x00000200 // OS supports FXSAVE/FXRSTOR
+#define CR4_OSXMMEXCPT 0x00000400 // OS supports unmasked SIMD exceptions
+#define CR4_OSXSAVE    0x00040000 // OS supports XSAVE and XCR0
+
+#define XCR0_X87 0x1 // x87 state
+#define XCR0_SSE 0x2 // SSE state
+#define XCR0_AVX 0x4 // AVX state
+
+// How fpu_save/fpu_restore in kern.S preserve FPU/SIMD state
+#define FPU_NONE   0
+#define FPU_FXSAVE 1
+#define FPU_XSAVE  2
+
 
 
 
@@ -243,11 +256,20 @@ struct Trapframe {
 #define T_MCHK      18          // machine check
 #define T_SIMDERR   19          // SIMD floating point error
 
+// Page fault error codes (tf_err)
+#define FEC_PR      0x1         // protection violation, page was present
+#define FEC_WR      0x2         // fault caused by a write
+#define FEC_U       0x4         // fault occurred in user mode
+
 // These are arbitrarily chosen, but with care not to overlap
 // processor defined exceptions or interrupt vectors.
 #define T_SYSCALL_PUTC   48          // system call
 #define T_SYSCALL_HLT   49          // system call
-#define T_ALL   50         // catchall
+#define T_SYSCALL_TS    50          // system call: report boot timestamp
+#define T_SYSCALL_NOP   51          // system call: does nothing
+#define T_SYSCALL_BENCH 52          // system call: report benchmark result
+#define T_SYSCALL_KBENCH 53         // system call: run kernel benchmarks
+#define T_ALL   54         // catchall
 
 #endif
 
@@ -0,0 +1,45 @@
+#include "lib.h"          // rdtsc()
+#include "bench.h"
+
+extern void __attribute__((regparm(1)))
+hlt ();
+
+#define ITERS 1000
+
+static void bench_report(int id, uint64_t cycles, uint32_t work)
+{
+  asm volatile("int %0"
+	       : : "i" (T_SYSCALL_BENCH), "a" ((uint32_t)cycles),
+		 "d" ((uint32_t)(cycles >> 32)), "c" (id), "b" (work)
+	       : "memory");
+}
+
+int main() {
+    uint64_t start;
+    int i;
+
+    start = rdtsc();
+    for (i = 0; i < ITERS; i++)
+	asm volatile("int %0" : : "i" (T_SYSCALL_PUTC), "a" (0) : "memory");
+    bench_report(BENCH_SYSCALL, rdtsc() - start, ITERS);
+
+    start = rdtsc();
+    for (i = 0; i < ITERS; i++)
+	asm volatile("int %0" : : "i" (T_SYSCALL_NOP) : "memory");
+    bench_report(BENCH_TRAP, rdtsc() - start, ITERS);
+
+    start = rdtsc();
+    for (i = 0; i < ITERS; i++)
+	(void)*(volatile uint8_t *)(BENCH_FAULT_VA + (i & 1) * PGSIZE);
+    bench_report(BENCH_PGFLT, rdtsc() - start, ITERS);
+
+    start = rdtsc();
+    for (i = 0; i < ITERS; i++)
+	(void)*(volatile uint32_t *)BENCH_MMIO_VA;
+    bench_report(BENCH_MMIO, rdtsc() - start, ITERS);
+
+    // BENCH_INVLPG, BENCH_TLB_MISS and BENCH_PIO need ring 0.
+    asm volatile("int %0" : : "i" (T_SYSCALL_KBENCH) : "memory");
+
+    hlt();
+}
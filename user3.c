@@ -1,3 +1,5 @@
+#include "lib.h"
+
 extern void __attribute__((regparm(1)))
 putc (char c);
 
@@ -21,6 +23,8 @@ void puts(const char *str) {
 
 
 int main() {
+    lib_init();
+
     puts("Here is user mode!!");
 
     puts("Let's call the function of PAGE2");